@@ -0,0 +1,230 @@
+"""
+Size budget report for PlatformIO
+
+Adds a 'size_budget' target that reads the linker map file and reports the
+static RAM, IRAM and flash use per subsystem (our sketch, MQTT, NeoPixel,
+IotWebConf, WiFi/web server, lwIP, SDK, core, libc).
+It fails only when one of the budgets set in platformio.ini is exceeded.
+
+Run it with: pio run -e d1_mini -t size_budget
+
+Budgets are optional platformio.ini options (bytes), unset ones are not checked:
+  custom_budget_ram          .data + .rodata + .bss (static RAM in DRAM)
+  custom_budget_iram         .text + .lit4 in IRAM (ICACHE_RAM_ATTR code etc.)
+  custom_budget_flash        everything that ends up in the firmware image
+  custom_budget_heap_min     DRAM that must be left for the heap at boot
+  custom_budget_<metric>_<subsystem>   e.g. custom_budget_ram_app = 4096
+  custom_budget_margin       percent added to the measured values that are
+                             printed as suggested budgets (default 5)
+
+The heap high-water mark can only be measured at runtime. The sketch shows
+the lowest free heap seen on its status page; heap_min here is the static
+upper bound of what the heap can ever get.
+"""
+
+import os
+import re
+from collections import OrderedDict
+
+Import("env")
+
+DRAM_SIZE = 81920  # ESP8266 dram0_0_seg, shared by static data and heap
+
+MAP_FILE = "${BUILD_DIR}/${PROGNAME}.map"
+
+# Output section -> region it counts towards, following the output sections of the
+# core's tools/sdk/ld/eagle.app.v6.common.ld.h:
+#   dram0_0_seg: .data .noinit .rodata .bss
+#   iram1_0_seg: .text .lit4
+#   irom0_0_seg: .irom0.text
+# .data, .rodata, .text and .lit4 are also stored in the firmware image (flash).
+# Output sections that are not listed here are reported as a warning, so a core
+# with a different linker script cannot silently under-report.
+SECTIONS = {
+    ".data": ("ram", "flash"),
+    ".noinit": ("ram",),
+    ".rodata": ("ram", "flash"),
+    ".bss": ("ram",),
+    ".text": ("iram", "flash"),
+    ".lit4": ("iram", "flash"),
+    ".irom0.text": ("flash",),
+}
+
+# Output sections that do not take RAM or flash on the device (debug info).
+IGNORED_SECTIONS = re.compile(r"^\.(debug|comment|xtensa\.info|xt\.|xt_|stab|ARM\.attributes)")
+
+# First match wins, checked against the object/archive path from the map file.
+# Objects built from the sketch in $BUILD_DIR/src/ are counted as "app" before these.
+SUBSYSTEMS = [
+    ("mqtt", re.compile(r"PubSubClient")),
+    ("neopixel", re.compile(r"Adafruit.NeoPixel")),
+    ("webconf", re.compile(r"IotWebConf")),
+    ("wifi_web", re.compile(r"ESP8266WiFi|ESP8266WebServer|DNSServer|HTTPUpdateServer|ESP8266mDNS")),
+    ("lwip", re.compile(r"liblwip")),
+    # Before sdk: newlib lives in tools/sdk/libc/, next to the SDK archives.
+    ("libc", re.compile(r"lib(c|m|gcc|stdc\+\+)\.a")),
+    # libhal (Xtensa HAL) ships in tools/sdk/lib/ and is counted as SDK.
+    ("sdk", re.compile(r"tools[/\\]sdk[/\\]lib[/\\]|libbearssl|libcrypto|libmain|libnet80211|libphy|libpp|libwpa")),
+    ("core", re.compile(r"FrameworkArduino|cores[/\\]esp8266")),
+]
+
+METRICS = ("ram", "iram", "flash")
+
+# Per subsystem budgets that are suggested after a run. The others are only reported.
+SUGGESTED_SUBSYSTEMS = ("app",)
+
+OUTPUT_RE = re.compile(r"^(\.\S+)")
+INPUT_RE = re.compile(r"^ (\S+)\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S.*)$")
+NAME_ONLY_RE = re.compile(r"^ ([.\w]\S*)$")
+WRAPPED_RE = re.compile(r"^\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S.*)$")
+
+
+def app_dirs(env):
+    """$BUILD_DIR/src/ as absolute path and relative to the project, the map file may use either."""
+    build_dir = env.subst("$BUILD_DIR")
+    dirs = [os.path.abspath(build_dir),
+            os.path.relpath(os.path.abspath(build_dir), env.subst("$PROJECT_DIR"))]
+    return tuple(d.replace("\\", "/").rstrip("/") + "/src/" for d in dirs)
+
+
+def subsystem_of(path, app=()):
+    path = path.replace("\\", "/")
+    if path.startswith(app) or path.startswith(tuple("./" + d for d in app)):
+        return "app"
+    for name, pattern in SUBSYSTEMS:
+        if pattern.search(path):
+            return name
+    return "other"
+
+
+def parse_map(path, app=()):
+    """Return {subsystem: {metric: bytes}} from a GNU ld map file."""
+    usage = OrderedDict((name, dict.fromkeys(METRICS, 0))
+                        for name in ["app"] + [name for name, _ in SUBSYSTEMS] + ["other"])
+    in_memory_map = False
+    section = None
+    pending = False
+    unknown = set()
+
+    def add(size, origin):
+        if size == 0:
+            return
+        if section not in SECTIONS:
+            if not IGNORED_SECTIONS.match(section or ""):
+                unknown.add(section)
+            return
+        for metric in SECTIONS[section]:
+            usage[subsystem_of(origin, app)][metric] += size
+
+    with open(path) as map_file:
+        for line in map_file:
+            line = line.rstrip("\n")
+            if not in_memory_map:
+                in_memory_map = line.startswith("Linker script and memory map")
+                continue
+            if line.startswith("OUTPUT("):
+                break
+
+            match = OUTPUT_RE.match(line)
+            if match:
+                section = match.group(1)
+                pending = False
+                continue
+
+            match = INPUT_RE.match(line)
+            if match:
+                add(int(match.group(3), 16), match.group(4))
+                pending = False
+                continue
+
+            # Long input section names put address, size and file on the next line.
+            if NAME_ONLY_RE.match(line):
+                pending = True
+                continue
+            if pending:
+                match = WRAPPED_RE.match(line)
+                if match:
+                    add(int(match.group(2), 16), match.group(3))
+                pending = False
+
+    for name in sorted(unknown):
+        print("Warning: output section %s is not counted, add it to SECTIONS in size_budget.py" % name)
+    return usage
+
+
+def with_margin(size, margin):
+    return -(-size * (100 + margin) // 100)  # round up
+
+
+def budget(metric, subsystem=None):
+    option = "custom_budget_" + metric
+    if subsystem:
+        option += "_" + subsystem
+    value = env.GetProjectOption(option, "")
+    return int(value) if str(value).strip() else None
+
+
+def size_budget(target, source, env):
+    map_path = env.subst(MAP_FILE)
+    usage = parse_map(map_path, app_dirs(env))
+    totals = dict((metric, sum(row[metric] for row in usage.values())) for metric in METRICS)
+    failures = []
+    checked = 0
+
+    print("")
+    print("Size budget report (%s)" % env.subst("$PIOENV"))
+    print("%-10s %10s %10s %10s" % ("subsystem", "ram", "iram", "flash"))
+    for name, row in usage.items():
+        if not any(row.values()):
+            continue
+        print("%-10s %10d %10d %10d" % (name, row["ram"], row["iram"], row["flash"]))
+        for metric in METRICS:
+            limit = budget(metric, name)
+            checked += limit is not None
+            if limit is not None and row[metric] > limit:
+                failures.append("%s %s: %d > %d" % (name, metric, row[metric], limit))
+    print("%-10s %10d %10d %10d" % ("total", totals["ram"], totals["iram"], totals["flash"]))
+
+    heap_at_boot = DRAM_SIZE - totals["ram"]
+    print("heap available at boot: %d bytes (runtime minimum is shown on the status page)" % heap_at_boot)
+
+    for metric in METRICS:
+        limit = budget(metric)
+        checked += limit is not None
+        if limit is not None and totals[metric] > limit:
+            failures.append("total %s: %d > %d" % (metric, totals[metric], limit))
+    limit = budget("heap_min")
+    checked += limit is not None
+    if limit is not None and heap_at_boot < limit:
+        failures.append("heap at boot: %d < %d" % (heap_at_boot, limit))
+
+    margin = int(env.GetProjectOption("custom_budget_margin", "5"))
+    print("")
+    print("Measured values + %d%%, to paste into platformio.ini:" % margin)
+    for metric in METRICS:
+        print("custom_budget_%s = %d" % (metric, with_margin(totals[metric], margin)))
+    print("custom_budget_heap_min = %d" % (heap_at_boot * 100 // (100 + margin)))
+    for name in SUGGESTED_SUBSYSTEMS:
+        print("custom_budget_ram_%s = %d" % (name, with_margin(usage[name]["ram"], margin)))
+
+    if failures:
+        print("")
+        for failure in failures:
+            print("BUDGET EXCEEDED: " + failure)
+        return 1
+    if not checked:
+        print("")
+        print("No custom_budget_* values set in platformio.ini, only reported.")
+        return 0
+    print("All size budgets met.")
+    return 0
+
+
+env.Append(LINKFLAGS=["-Wl,-Map," + MAP_FILE])
+
+env.AddCustomTarget(
+    name="size_budget",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=size_budget,
+    title="Size Budget",
+    description="Report RAM/flash use per subsystem and check the budgets")
@@ -58,6 +58,7 @@ const char wifiInitialApPassword[] = "password";
 
 #define STRING_LEN 128
 #define NUMBER_LEN 32
+#define CLIENTID_LEN 32 //thingName (< 16) + ChipID (max 10 digits) + '\0'
 // -- Configuration specific key. The value should be modified if config structure was changed.
 #define CONFIG_VERSION "npxk3"
 
@@ -86,6 +87,13 @@ void colorWipeOut(uint32_t c, uint8_t wait);
 void theaterChase(uint32_t c, uint8_t wait);
 void ICACHE_RAM_ATTR ColorISR();
 void ICACHE_RAM_ATTR PatternISR();
+void sampleFreeHeap();
+
+// -- Free heap low-water mark kept by umm_malloc itself (umm_free_heap_size_lw_min()). Not every core
+//      version has it, so it is bound weak under a name of our own: this never clashes with (or inherits the
+//      section of) a declaration in the core headers, and it is NULL when the core does not provide it.
+//      sampleFreeHeap() then falls back to ESP.getFreeHeap().
+extern "C" size_t heapLowWaterMark(void) __asm__("umm_free_heap_size_lw_min") __attribute__((weak));
 
 DNSServer dnsServer;
 WebServer server(80);
@@ -107,7 +115,7 @@ char mqttTopicReceiveValue[STRING_LEN];
 char ledOffsetValue[NUMBER_LEN];
 char ledBrightnessValue[NUMBER_LEN];
 
-char mqttClientId[STRING_LEN]; //automatically created. not via config!
+char mqttClientId[CLIENTID_LEN]; //automatically created. not via config!
 
 IotWebConf iotWebConf(thingName, &dnsServer, &server, wifiInitialApPassword, CONFIG_VERSION);
 IotWebConfTextParameter mqttServerParam = IotWebConfTextParameter("MQTT server", "mqttServer", mqttServerValue, STRING_LEN);
@@ -140,35 +148,56 @@ Adafruit_NeoPixel strip = Adafruit_NeoPixel(NUMBEROFLEDS, PIN, NEO_GRB + NEO_KHZ
 // and minimize distance between Arduino and first pixel.  Avoid connecting
 // on a live circuit...if you must, connect GND first.
 
-int pixel = 0;      //Indicate which Pixel to light
-int inConfig = 0;  //Indicator if you are on config portal or not (for blocking Led Pattern)
-long lastMsg = 0;   //timestamp of last MQTT Publish
+#define RECEIVE_LED 1                    //MQTT Led number of which the color is shown on the receiving half
+#define SEND_LED ((NUMBEROFLEDS/2)+1)    //MQTT Led number holding the color we send (7 for 12 leds)
 
-//long previous_time = 0;
-//long current_time = 0;
-bool needReset = false;
+/*
+Color codes as stored in DeviceState (receiveColor/sendColor). The index in ledColors[] is the color code.
+  off (0), green (1), red (2), yellow (3), purple (4), blue (5), white (6)
+*/
+struct LedColor {
+  const char* name; //MQTT payload
+  uint8_t r, g, b;
+};
+const LedColor ledColors[] = {
+  {"off",      0,   0,   0},
+  {"green",    0, 255,   0},
+  {"red",    255,   0,   0},
+  {"yellow", 128, 128,   0},
+  {"purple", 128,   0, 128},
+  {"blue",     0,   0, 255},
+  {"white",  200, 200, 200},
+};
+#define NUMBEROFCOLORS ((uint8_t)(sizeof(ledColors)/sizeof(ledColors[0])))
 
-bool patternInterrupt = false;
-bool colorInterrupt = false;
-long patternTime = 0;
-long colorTime = 0;
+/*
+All runtime state of the device in one struct (16 bytes).
+Members are ordered by size so the 32 bit timestamps stay aligned and only the end is padded.
 
-bool updateLedsIn = false;
-bool updateLedsOut = false;
-bool bootup = true;
+Only two MQTT Leds are used: Led RECEIVE_LED (1) colors the receiving half and Led SEND_LED
+(7 for 12 leds) restores our own send color after a reboot. So only those two color codes are stored.
+Messages for other Leds (some/thing/3, some/thing/13 or some/thing/wrong) are ignored.
 
-/*
-Assume NUMBEROFLEDS is 12, so using a 12 pixel led ring (or strip)
-ledStateArr[] stores the state (color/blinking) of each Led Pixel. Leds start at 1 and count up.
-ledStateArr[1] contains the state of Led 1
-ledStateArr[12] contains the state of Led 12 
-ledStateArr[0] contains 'garbage'. If you would send a MQTT topic like: some/thing/13 which is a not existing led
-                                   then that will be captured and stored in ledStateArr[0] (only if content is valid)
-                                   The same applies if you would have some/thing/wrong. That would also go to [0] (only if content is valid)
-So this is a bit different than usual where Array position 0 is the first position. 
-From MQTT I want to drive Led 1 to 12. Not led 0 to 11.
+The ISR flags are volatile bools of their own (not bitfields) so the ISR never does a
+read-modify-write on a byte that loop() is changing at the same time.
 */
-int ledStateArr[NUMBEROFLEDS+1]; //Store state of each led (where Led 1 = ledStateArr[1] and not ledStateArr[0])
+struct DeviceState {
+  volatile uint32_t patternTime;    //millis() of last pattern button change (PatternISR)
+  volatile uint32_t colorTime;      //millis() of last color button change (ColorISR)
+  volatile bool patternInterrupt;   //set by PatternISR, cleared in loop()
+  volatile bool colorInterrupt;     //set by ColorISR, cleared in loop()
+  bool updateLedsIn : 1;            //receiving half needs to be redrawn
+  bool updateLedsOut : 1;           //sending half needs to be redrawn and published
+  bool bootup : 1;                  //waiting for our retained send color after a reboot
+  bool needReset : 1;               //reboot after the configuration was saved
+  bool inConfig : 1;                //on config portal (for blocking Led Pattern)
+  uint8_t receiveColor;             //color code of MQTT Led RECEIVE_LED
+  uint8_t sendColor;                //color code of MQTT Led SEND_LED
+};
+
+DeviceState state = {0, 0, false, false, false, false, true, false, false, 0, 0};
+
+uint32_t minFreeHeap = 0; //lowest free heap seen (heap high-water mark), shown on status page. Seeded in setup()
 
 
 //***************************** SETUP ***************************************************
@@ -176,6 +205,7 @@ void setup() {
 
   Serial.begin(115200);
   Serial.println();
+  minFreeHeap = ESP.getFreeHeap();
   Serial.println("Starting up...");
 
 
@@ -249,7 +279,7 @@ void setup() {
 
 //Create UNIQUE MQTT ClientId - When not unique on the same MQTT server, you'll get strange behaviour
 //It uses the unique chipID of the ESP.
-sprintf(mqttClientId, "%s%u", thingName,ESP.getChipId()); 
+snprintf(mqttClientId, CLIENTID_LEN, "%s%u", thingName,ESP.getChipId()); 
 Serial.print("mqttclientid: ");
 Serial.println(mqttClientId);
 }
@@ -258,15 +288,16 @@ Serial.println(mqttClientId);
 
 /*
 MQTT Callback function
-Determine Topic number and store the payload in ledStateArr (Array)
+Determine Topic number and store the payload in state (receiveColor or sendColor)
 */
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
 
   int LedId = 0;
+  uint8_t *ledColor;
 
   //you should subscribe to topics like topic/# or topic/subtopic/#
   //This will result in topics like: topic/subtopic/0, topic/subtopic/1 where the number corresponds with the LED
-  //ledStateArr[LedId] will contain the led status (what color you want) per led.
+  //state.receiveColor and state.sendColor will contain the led status (what color you want).
   
   char *token = strtok(topic, "/"); //split on /
     // Keep printing tokens while one of the 
@@ -280,8 +311,12 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
   //half of the pixels + 1 is the LedId that is used to show the previously send item of the device itself
   //this is used to restore the display in case of a reboot.
 
-    if(LedId > (NUMBEROFLEDS/2)+1 ) 
-    LedId = 0;             //Send the value to index 0 which is not used (ledStateArr[0] is not used)
+    if(LedId == RECEIVE_LED)
+      ledColor = &state.receiveColor;
+    else if(LedId == SEND_LED)
+      ledColor = &state.sendColor;
+    else
+      return;              //Not a led we use, ignore the message
 
   //Serial.print("Token: ");
   //Serial.println(LedId);
@@ -294,46 +329,20 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
   //}
 
 
-  /*
-  Define color codes and with or without blink:
-  green (1)
-  red (2)
-  yellow (3)
-  purple (4)
-  blue (5)
-  white (6)
-  off (0)
-  
-  */
-  //check for possible topics
-  if(strcmp((char*)payload,"green") == 0){ 
-      ledStateArr[LedId] = 1;
+  //check for possible colors (see ledColors[])
+  for(uint8_t color = 0; color < NUMBEROFCOLORS; color++){
+    if(strcmp((char*)payload, ledColors[color].name) == 0){
+      *ledColor = color;
+      break;
     }
-  else if(strcmp((char*)payload,"red") == 0){
-          ledStateArr[LedId] = 2;
-    }
-  else if(strcmp((char*)payload,"yellow") == 0){
-          ledStateArr[LedId] = 3; 
-  }
-  else if(strcmp((char*)payload,"purple") == 0){
-        ledStateArr[LedId] = 4;
-    }
-  else if(strcmp((char*)payload,"blue") == 0){
-          ledStateArr[LedId] = 5;
-          }
-  else if(strcmp((char*)payload,"white") == 0){
-          ledStateArr[LedId] = 6; 
-  }
-    else if(strcmp((char*)payload,"off") == 0){
-          ledStateArr[LedId] = 0; 
   }
 
-  if(LedId == 7 && bootup == true){
-    updateLedsOut = true;
-    bootup = false;
+  if(LedId == SEND_LED && state.bootup == true){
+    state.updateLedsOut = true;
+    state.bootup = false;
 }
   else
-    updateLedsIn = true;
+    state.updateLedsIn = true;
 }
 //**************** END OF MQTT CALLBACK FUNCTION *********************************
 
@@ -370,121 +379,52 @@ void loop() {
   iotWebConf.doLoop();
   client.loop(); //make sure MQTT Keeps running (hopefully prevents watchdog from kicking in)
   delay(10);
+
+  sampleFreeHeap();
  
+  //Copy the ISR timestamps before reading millis(). Otherwise an ISR in between makes millis() - time underflow.
+  uint32_t patternTime = state.patternTime;
+  uint32_t colorTime = state.colorTime;
+
   //Handle Interrupt button press of pattern button 
-  if((patternInterrupt == true) && (millis() > (patternTime+200U))){ 
+  if((state.patternInterrupt == true) && (millis() - patternTime > 200U)){ 
     Serial.println("pattern interrupt");
-    patternInterrupt = false;
-    updateLedsOut = true;
+    state.patternInterrupt = false;
+    state.updateLedsOut = true;
     }
 
   //Handle Interrupt button press of color button
-  if((colorInterrupt == true) && (millis() > (colorTime+200U))){
+  if((state.colorInterrupt == true) && (millis() - colorTime > 200U)){
   
-    int LedId = (NUMBEROFLEDS/2)+1; //in case of 12 leds, divide by 2 = 6. Add 1 --> LedId = 7. So in the ledStateArr on position 7 we will have the color stored.
-    
-    if(ledStateArr[LedId] < 6) //max 6 colors + off combinations
-      ledStateArr[LedId] = ledStateArr[LedId]+1;
+    if(state.sendColor < NUMBEROFCOLORS-1) //max 6 colors + off combinations
+      state.sendColor = state.sendColor+1;
     else  
-      ledStateArr[LedId] = 0;
+      state.sendColor = 0;
 
-    Serial.print("LedStateArr: ");
-    Serial.println(ledStateArr[LedId]);
-    colorInterrupt = false;
-    updateLedsOut = true;
+    Serial.print("LedState: ");
+    Serial.println(state.sendColor);
+    state.colorInterrupt = false;
+    state.updateLedsOut = true;
   }
- /*
-  DRIVE THE LEDS
-  green (1)
-  red (2)
-  yellow (3)
-  purple (4)
-  blue (5)
-  white (6)
-  off (0)
-  */
- 
- 
-
-if(updateLedsIn == true){ //true means we want to only show one status in total on all leds where all leds are 50% of them.
-  int x = 1; 
-  if(ledStateArr[x] == 1) //GREEN
-      colorWipeIn(strip.Color(0, 255, 0), 100); // Green
-
-  //Check for 2nd topic
-  else if(ledStateArr[x] == 2) //RED
-    colorWipeIn(strip.Color(255, 0, 0), 100); // Red 
-    
-  else if(ledStateArr[x] == 3) //YELLOW
-    colorWipeIn(strip.Color(128, 128, 0), 100); // Red
-  
-  //Check for 4nd topic
-  else if(ledStateArr[x] == 4) //PURPLE
-    colorWipeIn(strip.Color(128, 0, 128), 100); // Purple
-
-  //BLUE SINGLE STATUS
-  else if(ledStateArr[x] == 5) //BLUE
-    colorWipeIn(strip.Color(0, 0, 255), 100); // Blue
 
-  //WHITE SINGLE STATUS  
-  else if(ledStateArr[x] == 6) //WHITE
-     colorWipeIn(strip.Color(200, 200, 200), 100); 
-  
-  //OFF
-  else if(ledStateArr[x] == 0) //LED OFF
-      colorWipeIn(strip.Color(0,0,0),0);
+ //DRIVE THE LEDS (color codes are the index in ledColors[])
 
-  updateLedsIn = false;
+if(state.updateLedsIn == true){ //true means we want to only show one status in total on all leds where all leds are 50% of them.
+  const LedColor &c = ledColors[state.receiveColor];
+  colorWipeIn(strip.Color(c.r, c.g, c.b), 100);
+  state.updateLedsIn = false;
 }
 
-if(updateLedsOut == true){
-   int x = (NUMBEROFLEDS/2)+1; //in case of 12 pixels, number 7 will contain the status for sending the data.
-
-  //GREEN SINGLE STATUS
-  if(ledStateArr[x] == 1){ //GREEN
-      colorWipeOut(strip.Color(0, 255, 0), 100); // Green
-      client.publish(mqttTopicSendValue, "green"); //publish 'color' message to topic.
-  }
-
- //RED SINGLE STATUS
-  else if(ledStateArr[x] == 2){ //RED
-    colorWipeOut(strip.Color(255, 0, 0), 100); // Red
-    client.publish(mqttTopicSendValue, "red"); //publish 'color' message to topic.
-}
-  //YELLOW SINGLE STATUS
-  else if(ledStateArr[x] == 3){ //YELLOW
-    colorWipeOut(strip.Color(128, 128, 0), 100); // yellow
-    client.publish(mqttTopicSendValue, "yellow"); //publish 'color' message to topic.
-  }
-
-  //PURPLE SINGLE STATUS
-  else if(ledStateArr[x] == 4){ //PURPLE
-    colorWipeOut(strip.Color(128, 0, 128), 100); // Purple
-    client.publish(mqttTopicSendValue, "purple"); //publish 'color' message to topic.
-  }
-  //BLUE SINGLE STATUS
-  else if(ledStateArr[x] == 5){ //BLUE
-    colorWipeOut(strip.Color(0, 0, 255), 100); // Blue
-    client.publish(mqttTopicSendValue, "blue"); //publish 'color' message to topic.
-  }
-
-  //WHITE SINGLE STATUS  
-  else if(ledStateArr[x] == 6){ //WHITE
-          colorWipeOut(strip.Color(200, 200, 200), 100); 
-          client.publish(mqttTopicSendValue, "white"); //publish 'color' message to topic.
-  }
-  //OFF
-   else if(ledStateArr[x] == 0){ //LED OFF
-        colorWipeOut(strip.Color(0, 0, 0), 0); 
-        client.publish(mqttTopicSendValue, "off"); //publish 'color' message to topic.
-    }
-  updateLedsOut = false;
-
+if(state.updateLedsOut == true){
+  const LedColor &c = ledColors[state.sendColor];
+  colorWipeOut(strip.Color(c.r, c.g, c.b), 100);
+  client.publish(mqttTopicSendValue, c.name); //publish 'color' message to topic.
+  state.updateLedsOut = false;
 }
 
 //Block updating the LEDs while in Configuration portal (inConfig)
 
-if(inConfig == 0) 
+if(state.inConfig == false) 
   strip.show(); //set all pixels  
  
 
@@ -495,7 +435,7 @@ if(inConfig == 0)
   client.loop();
   delay(10);
 
-  if (needReset)
+  if (state.needReset)
   {
     Serial.println("Rebooting after 1 second.");
     iotWebConf.delay(1000);
@@ -503,7 +443,8 @@ if(inConfig == 0)
   }
 /* 
 // Publish 'ONLINE' Message to Topic. Uncomment if you want to use this.
-  long now = millis();
+  static unsigned long lastMsg = 0;   //timestamp of last MQTT Publish
+  unsigned long now = millis();
   if (now - lastMsg > 10000) {
     lastMsg = now;
   client.publish("build/test", "ONLINE"); //publish 'ONLINE' message to topic.
@@ -524,7 +465,7 @@ void handleRoot()
     // -- Captive portal request were already served.
     return;
   }
-  inConfig = 1; //You are in the Config Portal
+  state.inConfig = true; //You are in the Config Portal
   showLedOffset(); //Show real LED1 and your Led 1 at offset
 
   String s = F("<!DOCTYPE html><html lang=\"en\"><head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/>");
@@ -554,6 +495,12 @@ void handleRoot()
   s += "<div>LED Brightness: ";
   s += ledBrightnessValue;
   s += "</div>";
+  sampleFreeHeap(); //the page is almost complete, so this is about the peak use of handleRoot()
+  s += "<div>Free heap: ";
+  s += ESP.getFreeHeap();
+  s += " bytes (lowest: ";
+  s += minFreeHeap;
+  s += " bytes)</div>";
   s += "<button type='button' onclick=\"location.href='';\" >Refresh</button>";
   s += "<div>Go to <a href='config'>configure page</a> to change values.</div>";
   s +="<div><small>MQTT NeoPixel Kids - Version: ";
@@ -575,8 +522,8 @@ void configSaved()
   Serial.println("Configuration was updated.");
   showLedOffset(); //Show real LED1 and your Led 1 at offset so you can check the offset
   delay(5000);
-  inConfig = 0; // Enable Led Pattern again
-  needReset = true; 
+  state.inConfig = false; // Enable Led Pattern again
+  state.needReset = true; 
 }
 
 bool formValidator(iotwebconf::WebRequestWrapper* webRequestWrapper)
@@ -602,6 +549,7 @@ bool formValidator(iotwebconf::WebRequestWrapper* webRequestWrapper)
 */
 void showLedOffset(){
 
+  int pixel;
   for(pixel =0;pixel < NUMBEROFLEDS;pixel++)
       strip.setPixelColor(pixel,strip.Color(0 ,0, 255)); //Set all leds to Blue
   strip.setPixelColor(0,strip.Color(255 ,0, 0)); //Set the offical first led to Red.
@@ -621,7 +569,7 @@ void colorWipeIn(uint32_t c, uint8_t wait) {
 
   for(uint16_t i=1; i<=NUMBEROFLEDS/2; i++) { 
          //Handle led_offset
-        pixel = (i-1) + atoi(ledOffsetValue);
+        int pixel = (i-1) + atoi(ledOffsetValue);
         if(pixel > (NUMBEROFLEDS-1)){
             pixel = pixel - NUMBEROFLEDS;
         }
@@ -635,7 +583,7 @@ void colorWipeOut(uint32_t c, uint8_t wait) {
 
   for(uint16_t i=(NUMBEROFLEDS/2)+1; i<=NUMBEROFLEDS; i++) { 
          //Handle led_offset
-        pixel = (i-1) + atoi(ledOffsetValue);
+        int pixel = (i-1) + atoi(ledOffsetValue);
         if(pixel > (NUMBEROFLEDS-1)){
             pixel = pixel - NUMBEROFLEDS;
         }
@@ -647,13 +595,24 @@ void colorWipeOut(uint32_t c, uint8_t wait) {
 void ICACHE_RAM_ATTR ColorISR(){
 //What to do when select button is pushed?
  // Serial.println("ColorISR");
-  colorInterrupt = true;
-  colorTime = millis();
+  state.colorInterrupt = true;
+  state.colorTime = millis();
 }
 
 void ICACHE_RAM_ATTR PatternISR(){
 //To commit the selected state to the other device
  //Serial.println("PatternISR");
- patternInterrupt = true;
- patternTime = millis();
-}
\ No newline at end of file
+ state.patternInterrupt = true;
+ state.patternTime = millis();
+}
+
+/*
+Keep track of the lowest free heap (heap high-water mark).
+umm_malloc's own low-water mark also catches the peaks in between two samples
+(web pages, config form, TCP buffers). Without it only the current free heap can be sampled.
+*/
+void sampleFreeHeap(){
+  uint32_t freeHeap = heapLowWaterMark ? heapLowWaterMark() : ESP.getFreeHeap();
+  if(freeHeap < minFreeHeap)
+    minFreeHeap = freeHeap;
+}